@@ -24,148 +24,2416 @@
 #include <linux/of_device.h>
 #include <linux/of_gpio.h>
 #include <linux/pwm.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/jump_label.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/iio/consumer.h>
+#include <linux/kref.h>
+
+#include "leds-tlc5940.h"
 
 #define DRIVER_NAME "leds-tlc5940"
 
 #define TLC5940_GSCLK_SPEED_HZ  250000
 #define TLC5940_GSCLK_PERIOD_NS (1000000000 / TLC5940_GSCLK_SPEED_HZ)
 #define TLC5940_GSCLK_DUTY_CYCLE_NS (TLC5940_GSCLK_PERIOD_NS / 2)
-#define TLC5940_BLANK_PERIOD_NS (4096 * TLC5940_GSCLK_PERIOD_NS)
+#define TLC5940_BLANK_PERIOD_NS(__bits) \
+	((1 << (__bits)) * TLC5940_GSCLK_PERIOD_NS)
 
 #define TLC5940_MAX_LEDS   16
 #define TLC5940_GS_CHANNEL_WIDTH 12
+#define TLC5940_GS_DEPTH_MIN 8
+#define TLC5940_PHASE_SCALE  1000
+
+/* master brightness scale applied while packing, TLC5940_SCALE_ONE is 1.0 */
+#define TLC5940_SCALE_SHIFT  12
+#define TLC5940_SCALE_ONE    (1 << TLC5940_SCALE_SHIFT)
+
+#define TLC5940_AMBIENT_POLL_MS    1000
+/* smoothed lux is kept with this many fractional bits */
+#define TLC5940_AMBIENT_FRAC_BITS  4
+/* weight of a new reading in the moving average, as a power of two */
+#define TLC5940_AMBIENT_SMOOTHING  3
+/* master scale changes smaller than this are ignored */
+#define TLC5940_AMBIENT_HYSTERESIS (TLC5940_SCALE_ONE / 32)
+
+/* bytes of queued stream frames, at least four frames of a full chain */
+#define TLC5940_STREAM_FIFO_SIZE 2048
+/*
+ * latch times of one frame FIFO of single-chip frames; stream frames are held
+ * back while it is full, so none are ever dropped
+ */
+#define TLC5940_STREAM_LATCH_DEPTH 128
+
+#define TLC5940_BITS_PER_WORD 8
+#define TLC5940_MAX_SPEED_HZ ((u32) (30e6))
+
+#define TLC5940_MAX_CHAIN  16
+
+#define TLC5940_FB_SIZE_BITS(__chips) ( \
+								  (__chips) * (TLC5940_MAX_LEDS) * \
+								  TLC5940_GS_CHANNEL_WIDTH \
+								)
+#define TLC5940_FB_SIZE(__chips) (TLC5940_FB_SIZE_BITS(__chips) >> 3)
+
+#define FB_OFFSET_BITS(__chips, __led) ( \
+								  (TLC5940_FB_SIZE_BITS(__chips)) - \
+								  (TLC5940_GS_CHANNEL_WIDTH * ((__led) + 1)) \
+								)
+#define FB_OFFSET(__chips, __led) (FB_OFFSET_BITS(__chips, __led) >> 3)
+
+#define TLC5940_GS_MAX     0xfff
+#define TLC5940_HUE_MAX    360
+#define TLC5940_GROUP_MAX  4
+
+#define TLC5940_CCT_MIN    1000
+#define TLC5940_CCT_MAX    10000
+#define TLC5940_CCT_STEP   500
+
+/*
+ * blackbody RGB at TLC5940_CCT_MIN + (i * TLC5940_CCT_STEP) kelvin, scaled to
+ * the 12-bit grayscale range
+ */
+static const u16 tlc5940_cct_table[][3] = {
+	{ 4095, 1091,    0 }, { 4095, 1738,    0 }, { 4095, 2198,  223 },
+	{ 4095, 2554, 1125 }, { 4095, 2846, 1765 }, { 4095, 3092, 2262 },
+	{ 4095, 3305, 2667 }, { 4095, 3493, 3010 }, { 4095, 3662, 3307 },
+	{ 4095, 3814, 3569 }, { 4095, 3953, 3803 }, { 4095, 4081, 4015 },
+	{ 3896, 3888, 4095 }, { 3691, 3771, 4095 }, { 3552, 3690, 4095 },
+	{ 3448, 3628, 4095 }, { 3366, 3579, 4095 }, { 3297, 3537, 4095 },
+	{ 3239, 3502, 4095 },
+};
+
+struct tlc5940_led {
+	struct led_classdev ldev;
+	int                 id;
+	int                 brightness;
+	const char         *name;
+	struct tlc5940     *tlc;
+	/* changes are latched right away instead of at the next BLANK period */
+	bool                urgent;
+	/* value actually shifted out while brightness increases are limited */
+	int                 output;
+	/* refresh cycles left in a fade started from the command ring */
+	unsigned int        fade_frames;
+	int                 fade_target;
+};
+
+/* grayscale data for every chip in the chain, in shift order */
+struct tlc5940_fb {
+	unsigned int        chips;
+	size_t              len;
+	u8                  data[];
+};
+
+/*
+ * Estimated LED load. Dot correction is left at its power-on full scale, so
+ * each channel draws imax_ua scaled by its grayscale value; the grayscale sums
+ * are kept up to date as channels change and energy is integrated between
+ * changes. total_gs only covers the chips currently in the chain.
+ */
+struct tlc5940_power {
+	u32                 imax_ua;
+	u32                 supply_uv;
+	u32                 chip_gs[TLC5940_MAX_CHAIN];
+	u32                 total_gs;
+
+	u64                 energy_uj;
+	u32                 energy_rem_pj;
+	ktime_t             last;
+};
+
+/*
+ * Fault injection knobs (exposed in debugfs) and the time it took the output
+ * to show a correct frame again after the most recent fault.
+ */
+struct tlc5940_fault {
+	bool                enabled;
+	u32                 fail_nth;
+	u32                 delay_us;
+	u32                 drop_blank;
+
+	u32                 count;
+	u64                 recovery_last_ns;
+	u64                 recovery_max_ns;
+	ktime_t             start;
+	bool                pending;
+	bool                shifted;
+};
+
+/*
+ * Optional per-frame stages are behind static keys, enabled while at least one
+ * device uses them, so the plain refresh path carries no extra branches.
+ */
+static DEFINE_STATIC_KEY_FALSE(tlc5940_fault_key);
+static DEFINE_STATIC_KEY_FALSE(tlc5940_resize_key);
+static DEFINE_STATIC_KEY_FALSE(tlc5940_urgent_key);
+static DEFINE_STATIC_KEY_FALSE(tlc5940_depth_key);
+static DEFINE_STATIC_KEY_FALSE(tlc5940_inrush_key);
+static DEFINE_STATIC_KEY_FALSE(tlc5940_raw_key);
+static DEFINE_STATIC_KEY_FALSE(tlc5940_ring_key);
+static DEFINE_STATIC_KEY_FALSE(tlc5940_scale_key);
+
+/* serializes enabling and disabling of the optional stages */
+static DEFINE_MUTEX(tlc5940_stage_lock);
+
+struct tlc5940 {
+	struct tlc5940_led *leds;
+	int                 num_leds;
+	struct tlc5940_fb  *fb;
+	/* replaces fb at the next frame boundary after a chain resize */
+	struct tlc5940_fb  *next_fb;
+	bool                new_gs_data;
+
+	/* protects channel brightness against concurrent packing */
+	spinlock_t          lock;
+
+	int                 gpio_blank;
+	struct hrtimer      timer;
+	/*
+	 * BLANK is pulsed every 2^gs_depth GSCLK cycles; below 12 bits the
+	 * grayscale values are rescaled to match and refresh rate goes up.
+	 * Frames are packed at gs_depth_next, and gs_depth and the period only
+	 * follow once the first such frame has been shifted out, so that the
+	 * BLANK latching it starts a cycle of the matching length
+	 */
+	unsigned int        gs_depth;
+	unsigned int        gs_depth_next;
+	u32                 blank_period_ns;
+	bool                blank_realign;
+	/*
+	 * offset of this chain's BLANK pulses in thousandths of a period, or
+	 * negative to let the timer run free of the shared phase grid
+	 */
+	int                 blank_phase;
+
+	/*
+	 * When non-zero, caps the sum of brightness increases shifted out per
+	 * frame; pending_rise is the sum of increases not yet shown
+	 */
+	u32                 max_rise;
+	u32                 pending_rise;
+
+	/*
+	 * In raw mode frames written by userspace are shifted out as they are
+	 * instead of being packed from the channel brightness values
+	 */
+	bool                raw_mode;
+	bool                raw_pending;
+	size_t              raw_len;
+	u8                  raw[TLC5940_FB_SIZE(TLC5940_MAX_CHAIN)];
+
+	/*
+	 * Raw frames streamed through the character device are shifted out one
+	 * per refresh cycle; the latch time of each one is queued for reading
+	 * back once the BLANK pulse after it has latched it
+	 */
+	struct miscdevice   misc;
+	char                misc_name[32];
+	/* held by the driver and by an open stream file, which may outlive it */
+	struct kref         refs;
+	unsigned long       stream_busy;
+	struct mutex        frame_lock;
+	struct mutex        latch_lock;
+	bool                stream_frame;
+	bool                stream_shifted;
+	wait_queue_head_t   frame_wait;
+	wait_queue_head_t   latch_wait;
+	DECLARE_KFIFO(frames, u8, TLC5940_STREAM_FIFO_SIZE);
+	DECLARE_KFIFO(latched, u64, TLC5940_STREAM_LATCH_DEPTH);
+
+	/* command ring mapped by the stream device's producer, if any */
+	struct tlc5940_ring *ring;
+	u32                 ring_tail;
+	unsigned int        fades;
+
+	/* ordered, so the timer and urgent commits never run the work at once */
+	struct workqueue_struct *wq;
+	struct work_struct  work;
+	struct spi_device  *spi;
+	struct pwm_device  *pwm;
+
+	bool                urgent;
+	bool                urgent_pending;
+	bool                stopping;
+	ktime_t             urgent_start;
+	u64                 urgent_latency_last_ns;
+	u64                 urgent_latency_max_ns;
+
+	struct tlc5940_power power;
+
+	struct tlc5940_fault fault;
+	struct dentry      *debugfs;
+
+	/*
+	 * Ambient light sensor polled at a low rate to dim all channels through
+	 * master_scale; lux readings map linearly onto the scale between
+	 * ambient_lux_min (min_scale) and ambient_lux_max (full scale)
+	 */
+	struct iio_channel *ambient;
+	struct delayed_work ambient_work;
+	u32                 ambient_lux_min;
+	u32                 ambient_lux_max;
+	u32                 ambient_min_scale;
+	s64                 ambient_smoothed;
+	bool                ambient_primed;
+	u32                 master_scale;
+
+};
+
+static void tlc5940_ring_run(struct tlc5940 *const tlc);
+
+/*
+ * A fault is recovered from once a complete frame has been shifted out and
+ * latched by a BLANK pulse after it.
+ */
+static void
+tlc5940_fault_begin(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_fault *const fault = &tlc->fault;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		fault->count++;
+		if (!fault->pending) {
+			fault->start = ktime_get();
+			fault->pending = true;
+		}
+		fault->shifted = false;
+		tlc->new_gs_data = 1;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+}
+
+static void
+tlc5940_fault_shifted(struct tlc5940 *const tlc)
+{
+
+	unsigned long flags;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	tlc->fault.shifted = tlc->fault.pending;
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+}
+
+static void
+tlc5940_fault_latched(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_fault *const fault = &tlc->fault;
+	unsigned long flags;
+	u64 ns;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	if (fault->pending && fault->shifted) {
+		ns = ktime_to_ns(ktime_sub(ktime_get(), fault->start));
+		fault->recovery_last_ns = ns;
+		fault->recovery_max_ns = max(fault->recovery_max_ns, ns);
+		fault->pending = false;
+		fault->shifted = false;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+}
+
+static int
+tlc5940_fault_enable_get(void *const data, u64 *const val)
+{
+
+	struct tlc5940 *const tlc = data;
+
+	*val = tlc->fault.enabled;
+
+	return 0;
+
+}
+
+static int
+tlc5940_fault_enable_set(void *const data, const u64 val)
+{
+
+	struct tlc5940 *const tlc = data;
+	struct tlc5940_fault *const fault = &tlc->fault;
+	const bool enable = val != 0;
+
+	mutex_lock(&tlc5940_stage_lock);
+
+	if (enable != fault->enabled) {
+		if (enable) {
+			static_branch_inc(&tlc5940_fault_key);
+		} else {
+			fault->fail_nth = 0;
+			fault->delay_us = 0;
+			fault->drop_blank = 0;
+			static_branch_dec(&tlc5940_fault_key);
+		}
+		fault->enabled = enable;
+	}
+
+	mutex_unlock(&tlc5940_stage_lock);
+
+	return 0;
+
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(
+  tlc5940_fault_enable_fops,
+  tlc5940_fault_enable_get,
+  tlc5940_fault_enable_set,
+  "%llu\n"
+);
+
+static void
+tlc5940_debugfs_init(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_fault *const fault = &tlc->fault;
+	char name[32];
+	struct dentry *dir;
+
+	snprintf(name, sizeof(name), DRIVER_NAME "-%s", dev_name(&tlc->spi->dev));
+
+	dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(dir)) {
+		return;
+	}
+
+	debugfs_create_file_unsafe("enable", 0600, dir, tlc,
+							   &tlc5940_fault_enable_fops);
+	debugfs_create_u32("fail_nth", 0600, dir, &fault->fail_nth);
+	debugfs_create_u32("delay_us", 0600, dir, &fault->delay_us);
+	debugfs_create_u32("drop_blank", 0600, dir, &fault->drop_blank);
+	debugfs_create_u32("faults", 0400, dir, &fault->count);
+	debugfs_create_u64("recovery_last_ns", 0400, dir,
+					   &fault->recovery_last_ns);
+	debugfs_create_u64("recovery_max_ns", 0400, dir,
+					   &fault->recovery_max_ns);
+
+	tlc->debugfs = dir;
+
+}
+
+/* completes the stream frame shifted out before this BLANK pulse */
+static void
+tlc5940_stream_latched(struct tlc5940 *const tlc)
+{
+
+	const u64 ns = ktime_to_ns(ktime_get());
+	unsigned long flags;
+	bool latched;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		latched = tlc->stream_shifted;
+		tlc->stream_shifted = false;
+		if (latched) {
+			kfifo_put(&tlc->latched, ns);
+			tlc->new_gs_data = 1;
+		}
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (latched) {
+		wake_up_interruptible(&tlc->latch_wait);
+	}
+
+}
+
+static void
+tlc5940_blank_pulse(struct tlc5940 *const tlc)
+{
+
+	gpio_set_value(tlc->gpio_blank, 1);
+	gpio_set_value(tlc->gpio_blank, 0);
+
+	if (static_branch_unlikely(&tlc5940_fault_key)) {
+		tlc5940_fault_latched(tlc);
+	}
+
+	if (static_branch_unlikely(&tlc5940_raw_key)) {
+		tlc5940_stream_latched(tlc);
+	}
+
+}
+
+/*
+ * Chains with a staggered BLANK phase keep their pulses on a grid of BLANK
+ * periods on the monotonic clock, shifted by their phase offset, so that the
+ * grayscale cycles of several chains start at different times. Returns the
+ * first slot at or after @t.
+ */
+static ktime_t
+tlc5940_blank_slot(const struct tlc5940 *const tlc, const ktime_t t)
+{
+
+	const u32 period = READ_ONCE(tlc->blank_period_ns);
+	const int phase = READ_ONCE(tlc->blank_phase);
+	u64 offset, ns;
+	u32 rem;
+
+	if (phase < 0) {
+		return t;
+	}
+
+	offset = div_u64((u64) period * phase, TLC5940_PHASE_SCALE);
+	ns = ktime_to_ns(t) - offset;
+	div_u64_rem(ns, period, &rem);
+	if (rem) {
+		ns += period - rem;
+	}
+
+	return ns_to_ktime(ns + offset);
+
+}
+
+/*
+ * Expiry of the next BLANK pulse when the grayscale cycle is restarted at
+ * @now. Snapping back onto the phase grid stretches or shortens that one cycle
+ * by at most half a period.
+ */
+static ktime_t
+tlc5940_blank_next(const struct tlc5940 *const tlc, const ktime_t now)
+{
+
+	const u32 period = READ_ONCE(tlc->blank_period_ns);
+
+	if (READ_ONCE(tlc->blank_phase) >= 0) {
+		return tlc5940_blank_slot(tlc, ktime_add_ns(now, period / 2));
+	}
+
+	return ktime_add_ns(now, period);
+
+}
+
+static void
+tlc5940_timer_realign(struct tlc5940 *const tlc)
+{
+
+	hrtimer_cancel(&tlc->timer);
+	hrtimer_start(
+	  &tlc->timer,
+	  tlc5940_blank_next(tlc, ktime_get()),
+	  HRTIMER_MODE_ABS
+	);
+
+}
+
+static enum hrtimer_restart
+tlc5940_timer_func(struct hrtimer *const timer)
+{
+
+	struct tlc5940 *const tlc = container_of(timer, struct tlc5940, timer);
+	struct spi_device *const spi = tlc->spi;
+	struct device *const dev = &spi->dev;
+	const int gpio_blank = tlc->gpio_blank;
+
+	if (unlikely(READ_ONCE(tlc->blank_realign))) {
+		/* the first cycle after a depth switch snaps onto the new grid */
+		WRITE_ONCE(tlc->blank_realign, false);
+		hrtimer_set_expires(timer, tlc5940_blank_next(tlc, ktime_get()));
+	} else {
+		hrtimer_forward_now(
+		  timer,
+		  ktime_set(0, READ_ONCE(tlc->blank_period_ns))
+		);
+	}
+
+	if (!gpio_is_valid(gpio_blank)) {
+		dev_err(dev, "invalid gpio %d, expiring timer\n", gpio_blank);
+		return HRTIMER_NORESTART;
+	}
+
+	if (static_branch_unlikely(&tlc5940_fault_key) && tlc->fault.drop_blank) {
+		tlc->fault.drop_blank--;
+		/* the latched data is still valid, the next BLANK restores it */
+		tlc5940_fault_begin(tlc);
+		tlc5940_fault_shifted(tlc);
+		return HRTIMER_RESTART;
+	}
+
+	tlc5940_blank_pulse(tlc);
+
+	if (tlc->new_gs_data ||
+		(static_branch_unlikely(&tlc5940_ring_key) && READ_ONCE(tlc->ring))) {
+		queue_work(tlc->wq, &tlc->work);
+	}
+
+	return HRTIMER_RESTART;
+
+}
+
+static u64
+tlc5940_power_current_ua(const struct tlc5940 *const tlc, const u32 gs)
+{
+
+	const u64 ua = div_u64((u64) tlc->power.imax_ua * gs, TLC5940_GS_MAX);
+
+	return (ua * tlc->master_scale) >> TLC5940_SCALE_SHIFT;
+
+}
+
+/*
+ * Integrates the energy drawn at the current load up to now. Called once
+ * before a batch of channel changes rather than for every channel.
+ *
+ * Must be called with tlc->lock held.
+ */
+static void
+tlc5940_power_account(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_power *const power = &tlc->power;
+	ktime_t now;
+	u64 uw, s;
+	u32 us;
+
+	/* without a current rating there is nothing to integrate */
+	if (!power->imax_ua) {
+		return;
+	}
+
+	now = ktime_get();
+	uw = div_u64(
+	  tlc5940_power_current_ua(tlc, power->total_gs) * power->supply_uv,
+	  USEC_PER_SEC
+	);
+	s = div_u64_rem(
+	  ktime_to_us(ktime_sub(now, power->last)),
+	  USEC_PER_SEC,
+	  &us
+	);
+	power->last = now;
+
+	/* uW * s = uJ, uW * us = pJ */
+	power->energy_uj += uw * s;
+	power->energy_uj += div_u64_rem(
+	  uw * us + power->energy_rem_pj,
+	  USEC_PER_SEC,
+	  &power->energy_rem_pj
+	);
+
+}
+
+/* whether a channel is shifted out; must be called with tlc->lock held */
+static bool
+tlc5940_visible(const struct tlc5940 *const tlc, const int id)
+{
+
+	return id < tlc->fb->chips * TLC5940_MAX_LEDS;
+
+}
+
+/*
+ * Must be called with tlc->lock held, after tlc5940_power_account() for the
+ * batch of changes this is part of.
+ */
+static void
+__tlc5940_set_channel(struct tlc5940 *const tlc, const int id, const int value)
+{
+
+	struct tlc5940_led *const led = &(tlc->leds[id]);
+	struct tlc5940_power *const power = &tlc->power;
+	const int delta = value - led->brightness;
+
+	if (delta) {
+		power->chip_gs[id / TLC5940_MAX_LEDS] += delta;
+		if (tlc5940_visible(tlc, id)) {
+			power->total_gs += delta;
+		}
+	}
+
+	/* only channels in the chain are stepped, see tlc5940_rise_recount() */
+	if (static_branch_unlikely(&tlc5940_inrush_key) && tlc->max_rise &&
+		tlc5940_visible(tlc, id)) {
+		tlc->pending_rise -= max(led->brightness - led->output, 0);
+		tlc->pending_rise += max(value - led->output, 0);
+	}
+
+	led->brightness = value;
+	led->ldev.brightness = value;
+
+}
+
+/* must be called with tlc->lock held; cancels any fade on the channel */
+static void
+tlc5940_set_channel(struct tlc5940 *const tlc, const int id, const int value)
+{
+
+	struct tlc5940_led *const led = &(tlc->leds[id]);
+
+	if (static_branch_unlikely(&tlc5940_ring_key) && led->fade_frames) {
+		led->fade_frames = 0;
+		tlc->fades--;
+	}
+
+	__tlc5940_set_channel(tlc, id, value);
+
+}
+
+/*
+ * Rebuilds pending_rise over the channels in the chain. Channels past its end
+ * are dark, so they rise from zero again once the chain grows back.
+ *
+ * Must be called with tlc->lock held.
+ */
+static void
+tlc5940_rise_recount(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_led *led;
+	int id;
+
+	tlc->pending_rise = 0;
+
+	for (id = 0; id < tlc->num_leds; id++) {
+		led = &(tlc->leds[id]);
+		if (tlc5940_visible(tlc, id)) {
+			tlc->pending_rise += max(led->brightness - led->output, 0);
+		} else {
+			led->output = 0;
+		}
+	}
+
+}
+
+static struct tlc5940_fb *
+tlc5940_fb_alloc(const unsigned int chips)
+{
+
+	const size_t len = TLC5940_FB_SIZE(chips);
+	struct tlc5940_fb *const fb = kzalloc(sizeof(*fb) + len, GFP_KERNEL);
+
+	if (!fb) {
+		return NULL;
+	}
+
+	fb->chips = chips;
+	fb->len = len;
+
+	return fb;
+
+}
+
+/*
+ * Only called from the work function between two transfers, so the old buffer
+ * is never in use when it is released.
+ */
+static void
+tlc5940_swap_fb(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_power *const power = &tlc->power;
+	struct tlc5940_fb *old = NULL;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	if (tlc->next_fb) {
+		old = tlc->fb;
+		tlc->fb = tlc->next_fb;
+		tlc->next_fb = NULL;
+
+		/* channels past the end of the chain draw no current */
+		tlc5940_power_account(tlc);
+		power->total_gs = 0;
+		for (i = 0; i < tlc->fb->chips; i++) {
+			power->total_gs += power->chip_gs[i];
+		}
+
+		if (static_branch_unlikely(&tlc5940_inrush_key) && tlc->max_rise) {
+			tlc5940_rise_recount(tlc);
+		}
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (old) {
+		static_branch_dec(&tlc5940_resize_key);
+		kfree(old);
+	}
+
+}
+
+/*
+ * Moves a channel's output towards its brightness within the frame's budget.
+ * Each channel takes a share of the budget proportional to its own pending
+ * increase, rounded up so the whole budget is used and the increase is spread
+ * over the least number of frames. Decreases are applied at once.
+ *
+ * Must be called with tlc->lock held.
+ */
+static int
+tlc5940_inrush_step(struct tlc5940 *const tlc, struct tlc5940_led *const led,
+					const u32 total, u32 *const budget)
+{
+
+	const int delta = led->brightness - led->output;
+	u32 step;
+
+	if (delta <= 0 || total <= tlc->max_rise) {
+		led->output = led->brightness;
+		return led->output;
+	}
+
+	step = DIV_ROUND_UP_ULL((u64) delta * tlc->max_rise, total);
+	step = min3(step, (u32) delta, *budget);
+
+	*budget -= step;
+	led->output += step;
+	tlc->pending_rise += led->brightness - led->output;
+
+	return led->output;
+
+}
+
+/*
+ * Returns true while limited brightness increases still need more frames;
+ * *depth is set to the grayscale depth the frame was packed at.
+ */
+static bool
+tlc5940_update_fb(struct tlc5940 *const tlc, unsigned int *const depth)
+{
+
+	const unsigned int chips = tlc->fb->chips;
+	const int channels = min_t(int, tlc->num_leds, chips * TLC5940_MAX_LEDS);
+	u8 *const fb = &(tlc->fb->data[0]);
+	unsigned int depth_shift;
+	unsigned long flags;
+	u32 scale;
+	bool inrush = false;
+	u32 rise_total = 0, rise_budget = 0;
+	int id;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+
+	/* the depth key is held for as long as this is below 12 bits */
+	*depth = tlc->gs_depth_next;
+	depth_shift = TLC5940_GS_CHANNEL_WIDTH - *depth;
+	scale = tlc->master_scale;
+
+	if (static_branch_unlikely(&tlc5940_inrush_key) && tlc->max_rise) {
+		inrush = true;
+		rise_total = tlc->pending_rise;
+		rise_budget = tlc->max_rise;
+		tlc->pending_rise = 0;
+	}
+
+	for (id = 0; id < channels; id++) {
+
+		struct tlc5940_led *const led = &(tlc->leds[id]);
+
+		u16 brightness = led->brightness & 0xfff;
+		const unsigned int offset = FB_OFFSET(chips, id);
+		const u8 mid_byte = id % 2 == 0;
+
+		if (inrush) {
+			brightness = tlc5940_inrush_step(
+			  tlc,
+			  led,
+			  rise_total,
+			  &rise_budget
+			) & 0xfff;
+		}
+
+		if (static_branch_unlikely(&tlc5940_scale_key)) {
+			brightness = (brightness * scale) >> TLC5940_SCALE_SHIFT;
+		}
+
+		if (static_branch_unlikely(&tlc5940_depth_key)) {
+			brightness >>= depth_shift;
+		}
+
+		if (mid_byte) {
+			fb[offset] = (fb[offset] & 0xf0) | brightness >> 8;
+			fb[offset + 1] = brightness & 0xff;
+		} else {
+			fb[offset] = brightness >> 4;
+			fb[offset + 1] = (fb[offset + 1] & 0x0f) | ((brightness << 4 & 0xf0));
+		}
+
+	}
+
+	inrush = inrush && tlc->pending_rise;
+
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return inrush;
+
+}
+
+/*
+ * Loads the next raw frame into the frame buffer: the next streamed frame
+ * once the previous one has been latched, else a frame written to the frame
+ * attribute. A streamed frame whose transfer failed stays in place and is
+ * sent again. Returns false when the device is not in raw mode and the frame
+ * has to be packed as usual; *more is set while streamed frames remain and
+ * *depth to the grayscale depth the frame is shown at.
+ */
+static bool
+tlc5940_update_fb_raw(struct tlc5940 *const tlc, bool *const more,
+					  unsigned int *const depth)
+{
+
+	struct tlc5940_fb *const fb = tlc->fb;
+	unsigned long flags;
+	bool raw, idle, streaming, loaded = false;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		raw = tlc->raw_mode;
+		*depth = tlc->gs_depth_next;
+		/* each stream frame needs room for its latch time */
+		streaming = !kfifo_is_empty(&tlc->frames) &&
+		  !kfifo_is_full(&tlc->latched);
+		idle = raw && !tlc->stream_frame && !tlc->stream_shifted;
+		if (idle && streaming && kfifo_len(&tlc->frames) >= fb->len) {
+			loaded = kfifo_out(&tlc->frames, fb->data, fb->len) == fb->len;
+			tlc->stream_frame = loaded;
+		} else if (idle && tlc->raw_pending) {
+			if (tlc->raw_len == fb->len) {
+				memcpy(fb->data, tlc->raw, fb->len);
+			}
+			tlc->raw_pending = false;
+		}
+		*more = raw && (tlc->stream_frame || streaming);
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (loaded) {
+		wake_up_interruptible(&tlc->frame_wait);
+	}
+
+	return raw;
+
+}
+
+static void
+tlc5940_stream_shifted(struct tlc5940 *const tlc)
+{
+
+	unsigned long flags;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	if (tlc->stream_frame) {
+		tlc->stream_frame = false;
+		tlc->stream_shifted = true;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+}
+
+/* takes the pending urgent commit, if any, before the frame is packed */
+static bool
+tlc5940_urgent_take(struct tlc5940 *const tlc, ktime_t *const start)
+{
+
+	unsigned long flags;
+	bool urgent;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		urgent = tlc->urgent_pending && !tlc->stopping;
+		tlc->urgent_pending = false;
+		*start = tlc->urgent_start;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return urgent;
+
+}
+
+/*
+ * Latches the frame that was just shifted out with an early BLANK pulse, which
+ * also restarts the grayscale cycle, and re-phases the BLANK timer from there.
+ */
+static void
+tlc5940_urgent_latch(struct tlc5940 *const tlc, const ktime_t start)
+{
+
+	struct hrtimer *const timer = &tlc->timer;
+	unsigned long flags;
+	u64 ns;
+
+	hrtimer_cancel(timer);
+	tlc5940_blank_pulse(tlc);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	hrtimer_start(
+	  timer,
+	  tlc5940_blank_next(tlc, ktime_get()),
+	  HRTIMER_MODE_ABS
+	);
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		tlc->urgent_latency_last_ns = ns;
+		tlc->urgent_latency_max_ns = max(tlc->urgent_latency_max_ns, ns);
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+}
+
+/*
+ * Called once the first frame packed at a new grayscale depth has been shifted
+ * out: the BLANK pulse that latches it still ends the current cycle on time,
+ * and the cycle it starts takes the new period.
+ */
+static void
+tlc5940_switch_depth(struct tlc5940 *const tlc, const unsigned int depth)
+{
+
+	unsigned long flags;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		tlc->gs_depth = depth;
+		WRITE_ONCE(tlc->blank_period_ns, TLC5940_BLANK_PERIOD_NS(depth));
+		/* the new period moves the pulses off the phase grid */
+		if (tlc->blank_phase >= 0) {
+			WRITE_ONCE(tlc->blank_realign, true);
+		}
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+}
+
+static void
+tlc5940_work(struct work_struct *const work)
+{
+
+	struct tlc5940 *const tlc = container_of(work, struct tlc5940, work);
+	struct spi_device *const spi = tlc->spi;
+	struct device *const dev = &spi->dev;
+	struct tlc5940_fault *const fault = &tlc->fault;
+	struct tlc5940_fb *fb;
+	ktime_t urgent_start;
+	bool urgent = false;
+	bool raw = false;
+	bool more;
+	unsigned int depth;
+	u32 delay_us;
+	int ret;
+
+	/* with a command ring mapped this runs every cycle, changed or not */
+	if (static_branch_unlikely(&tlc5940_ring_key)) {
+		tlc5940_ring_run(tlc);
+		if (!READ_ONCE(tlc->new_gs_data)) {
+			return;
+		}
+	}
+
+	if (static_branch_unlikely(&tlc5940_fault_key)) {
+		delay_us = fault->delay_us;
+		if (delay_us) {
+			fault->delay_us = 0;
+			tlc5940_fault_begin(tlc);
+			usleep_range(delay_us, delay_us + 1);
+		}
+	}
+
+	if (static_branch_unlikely(&tlc5940_resize_key)) {
+		tlc5940_swap_fb(tlc);
+	}
+	fb = tlc->fb;
+
+	if (static_branch_unlikely(&tlc5940_urgent_key)) {
+		urgent = tlc5940_urgent_take(tlc, &urgent_start);
+	}
+
+	/* anything changed from here on is picked up by the next frame */
+	tlc->new_gs_data = 0;
+
+	if (static_branch_unlikely(&tlc5940_raw_key)) {
+		raw = tlc5940_update_fb_raw(tlc, &more, &depth);
+	}
+	if (!raw) {
+		more = tlc5940_update_fb(tlc, &depth);
+	}
+
+	if (static_branch_unlikely(&tlc5940_fault_key) &&
+		fault->fail_nth && --fault->fail_nth == 0) {
+		ret = -EIO;
+	} else {
+		ret = spi_write(spi, fb->data, fb->len);
+	}
+
+	if (ret) {
+		dev_err(dev, "spi transfer error: %d\n", ret);
+		tlc->new_gs_data = 1;
+		if (static_branch_unlikely(&tlc5940_fault_key)) {
+			tlc5940_fault_begin(tlc);
+		}
+		return;
+	}
+
+	if (raw) {
+		tlc5940_stream_shifted(tlc);
+	}
+
+	if (depth != tlc->gs_depth) {
+		tlc5940_switch_depth(tlc, depth);
+	}
+
+	if (static_branch_unlikely(&tlc5940_fault_key)) {
+		tlc5940_fault_shifted(tlc);
+	}
+
+	if (urgent) {
+		tlc5940_urgent_latch(tlc, urgent_start);
+	}
+
+	if (more) {
+		tlc->new_gs_data = 1;
+	}
+
+}
+
+static void
+tlc5940_set_brightness(struct led_classdev *const ldev,
+					   const enum led_brightness brightness)
+{
+
+	struct tlc5940_led *const led = container_of(
+	  ldev,
+	  struct tlc5940_led,
+	  ldev
+	);
+
+	struct tlc5940 *const tlc = led->tlc;
+	bool urgent = static_branch_unlikely(&tlc5940_urgent_key) && led->urgent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		tlc5940_power_account(tlc);
+		tlc5940_set_channel(tlc, led->id, brightness);
+		tlc->new_gs_data = 1;
+		/* the work must not be queued again once it has been cancelled */
+		urgent = urgent && !tlc->stopping;
+		if (urgent && !tlc->urgent_pending) {
+			tlc->urgent_start = ktime_get();
+			tlc->urgent_pending = true;
+		}
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (urgent) {
+		queue_work(tlc->wq, &tlc->work);
+	}
+
+}
+
+static void
+tlc5940_hsv_to_rgb(const unsigned int h, const unsigned int s,
+				   const unsigned int v, u16 *const rgb)
+{
+
+	/* h is in degrees, s and v span the grayscale range */
+	const unsigned int sector = h / 60;
+	const unsigned int frac = (h % 60) * TLC5940_GS_MAX / 60;
+	const u16 p = v * (TLC5940_GS_MAX - s) / TLC5940_GS_MAX;
+	const u16 q = v * (TLC5940_GS_MAX - s * frac / TLC5940_GS_MAX) /
+	  TLC5940_GS_MAX;
+	const u16 t = v * (TLC5940_GS_MAX - s * (TLC5940_GS_MAX - frac) /
+	  TLC5940_GS_MAX) / TLC5940_GS_MAX;
+
+	switch (sector) {
+	case 0:
+		rgb[0] = v; rgb[1] = t; rgb[2] = p;
+		break;
+	case 1:
+		rgb[0] = q; rgb[1] = v; rgb[2] = p;
+		break;
+	case 2:
+		rgb[0] = p; rgb[1] = v; rgb[2] = t;
+		break;
+	case 3:
+		rgb[0] = p; rgb[1] = q; rgb[2] = v;
+		break;
+	case 4:
+		rgb[0] = t; rgb[1] = p; rgb[2] = v;
+		break;
+	default:
+		rgb[0] = v; rgb[1] = p; rgb[2] = q;
+		break;
+	}
+
+}
+
+static void
+tlc5940_cct_to_rgb(const unsigned int kelvin, const unsigned int intensity,
+				   u16 *const rgb)
+{
+
+	const unsigned int i = (kelvin - TLC5940_CCT_MIN) / TLC5940_CCT_STEP;
+	const unsigned int frac = (kelvin - TLC5940_CCT_MIN) % TLC5940_CCT_STEP;
+	const u16 *const lo = tlc5940_cct_table[i];
+	const u16 *const hi = tlc5940_cct_table[
+	  min_t(unsigned int, i + 1, ARRAY_SIZE(tlc5940_cct_table) - 1)
+	];
+	int c;
+
+	for (c = 0; c < 3; c++) {
+		const int base = lo[c] +
+		  ((int) hi[c] - lo[c]) * (int) frac / TLC5940_CCT_STEP;
+
+		rgb[c] = base * intensity / TLC5940_GS_MAX;
+	}
+
+}
+
+/*
+ * Applies one color to a group of three (RGB) or four (RGBW) channels in a
+ * single update so that the next frame never shows a partial color. For RGBW
+ * groups the common component of the color is moved onto the white channel.
+ *
+ * Must be called with tlc->lock held.
+ */
+static int
+__tlc5940_set_group(struct tlc5940 *const tlc, const int *const channels,
+					u16 *const values, const int count)
+{
+
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (channels[i] < 0 || channels[i] >= tlc->num_leds) {
+			return -EINVAL;
+		}
+	}
+
+	if (count == TLC5940_GROUP_MAX) {
+		values[3] = min3(values[0], values[1], values[2]);
+		values[0] -= values[3];
+		values[1] -= values[3];
+		values[2] -= values[3];
+	}
+
+	for (i = 0; i < count; i++) {
+		tlc5940_set_channel(tlc, channels[i], values[i]);
+	}
+	tlc->new_gs_data = 1;
+
+	return 0;
+
+}
+
+static int
+tlc5940_set_group(struct tlc5940 *const tlc, const int *const channels,
+				  u16 *const values, const int count)
+{
+
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	tlc5940_power_account(tlc);
+	ret = __tlc5940_set_group(tlc, channels, values, count);
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return ret;
+
+}
+
+/* must be called with tlc->lock held; malformed commands are skipped */
+static void
+tlc5940_ring_exec(struct tlc5940 *const tlc,
+				  const struct tlc5940_cmd *const cmd)
+{
+
+	const int id = cmd->channel[0];
+	int channels[TLC5940_GROUP_MAX];
+	u16 values[TLC5940_GROUP_MAX];
+	struct tlc5940_led *led;
+	int i, count;
+
+	switch (cmd->op) {
+	case TLC5940_CMD_SET:
+	case TLC5940_CMD_FADE:
+		if (id >= tlc->num_leds || cmd->value[0] > TLC5940_GS_MAX) {
+			return;
+		}
+		if (cmd->op == TLC5940_CMD_SET || cmd->arg == 0) {
+			tlc5940_set_channel(tlc, id, cmd->value[0]);
+			tlc->new_gs_data = 1;
+			return;
+		}
+		led = &(tlc->leds[id]);
+		if (!led->fade_frames) {
+			tlc->fades++;
+		}
+		led->fade_frames = cmd->arg;
+		led->fade_target = cmd->value[0];
+		return;
+	case TLC5940_CMD_HSV:
+		if (cmd->arg >= TLC5940_HUE_MAX ||
+			cmd->value[0] > TLC5940_GS_MAX || cmd->value[1] > TLC5940_GS_MAX) {
+			return;
+		}
+		tlc5940_hsv_to_rgb(cmd->arg, cmd->value[0], cmd->value[1], values);
+		break;
+	case TLC5940_CMD_CCT:
+		if (cmd->arg < TLC5940_CCT_MIN || cmd->arg > TLC5940_CCT_MAX ||
+			cmd->value[0] > TLC5940_GS_MAX) {
+			return;
+		}
+		tlc5940_cct_to_rgb(cmd->arg, cmd->value[0], values);
+		break;
+	default:
+		return;
+	}
+
+	count = cmd->channel[3] == TLC5940_CMD_NO_CHANNEL ? 3 : 4;
+	for (i = 0; i < count; i++) {
+		channels[i] = cmd->channel[i];
+	}
+
+	__tlc5940_set_group(tlc, channels, values, count);
+
+}
+
+/* moves every fading channel one refresh cycle closer to its target */
+static void
+tlc5940_fade_step(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_led *led;
+	int id, value;
+
+	for (id = 0; id < tlc->num_leds && tlc->fades; id++) {
+		led = &(tlc->leds[id]);
+		if (!led->fade_frames) {
+			continue;
+		}
+		value = led->brightness +
+		  (led->fade_target - led->brightness) / (int) led->fade_frames;
+		if (--led->fade_frames == 0) {
+			value = led->fade_target;
+			tlc->fades--;
+		}
+		__tlc5940_set_channel(tlc, id, value);
+	}
+
+	tlc->new_gs_data = 1;
+
+}
+
+/*
+ * Drains the command ring and advances fades. Commands are copied out of the
+ * shared page before use since the producer may rewrite them at any time, and
+ * a producer index more than a ring ahead discards the whole backlog.
+ */
+static void
+tlc5940_ring_run(struct tlc5940 *const tlc)
+{
+
+	struct tlc5940_ring *ring;
+	struct tlc5940_cmd cmd;
+	unsigned long flags;
+	u32 head, tail;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+
+	/* one integration step covers every command and fade below */
+	tlc5940_power_account(tlc);
+
+	ring = tlc->ring;
+	if (ring) {
+		tail = tlc->ring_tail;
+		head = smp_load_acquire(&ring->head);
+		if (head - tail > TLC5940_RING_ENTRIES) {
+			tail = head;
+		}
+		for (; tail != head; tail++) {
+			memcpy(
+			  &cmd,
+			  &ring->cmds[tail % TLC5940_RING_ENTRIES],
+			  sizeof(cmd)
+			);
+			tlc5940_ring_exec(tlc, &cmd);
+		}
+		tlc->ring_tail = tail;
+		smp_store_release(&ring->tail, tail);
+	}
+
+	if (tlc->fades) {
+		tlc5940_fade_step(tlc);
+	}
+
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+}
+
+/* "<hue> <saturation> <value> <r> <g> <b> [<w>]" */
+static ssize_t
+hsv_store(struct device *const dev, struct device_attribute *const attr,
+		  const char *const buf, const size_t count)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	int channels[TLC5940_GROUP_MAX];
+	u16 values[TLC5940_GROUP_MAX];
+	unsigned int h, s, v;
+	int n, ret;
+
+	n = sscanf(
+	  buf,
+	  "%u %u %u %d %d %d %d",
+	  &h, &s, &v,
+	  &channels[0], &channels[1], &channels[2], &channels[3]
+	);
+	if (n < 6) {
+		return -EINVAL;
+	}
+
+	if (h >= TLC5940_HUE_MAX || s > TLC5940_GS_MAX || v > TLC5940_GS_MAX) {
+		return -EINVAL;
+	}
+
+	tlc5940_hsv_to_rgb(h, s, v, values);
+
+	ret = tlc5940_set_group(tlc, channels, values, n - 3);
+
+	return ret ? : count;
+
+}
+
+/* "<kelvin> <intensity> <r> <g> <b> [<w>]" */
+static ssize_t
+cct_store(struct device *const dev, struct device_attribute *const attr,
+		  const char *const buf, const size_t count)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	int channels[TLC5940_GROUP_MAX];
+	u16 values[TLC5940_GROUP_MAX];
+	unsigned int kelvin, intensity;
+	int n, ret;
+
+	n = sscanf(
+	  buf,
+	  "%u %u %d %d %d %d",
+	  &kelvin, &intensity,
+	  &channels[0], &channels[1], &channels[2], &channels[3]
+	);
+	if (n < 5) {
+		return -EINVAL;
+	}
+
+	if (kelvin < TLC5940_CCT_MIN || kelvin > TLC5940_CCT_MAX ||
+		intensity > TLC5940_GS_MAX) {
+		return -EINVAL;
+	}
+
+	tlc5940_cct_to_rgb(kelvin, intensity, values);
+
+	ret = tlc5940_set_group(tlc, channels, values, n - 2);
+
+	return ret ? : count;
+
+}
+
+static ssize_t
+chain_length_show(struct device *const dev,
+				  struct device_attribute *const attr, char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int chips;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	chips = tlc->next_fb ? tlc->next_fb->chips : tlc->fb->chips;
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return sprintf(buf, "%u\n", chips);
+
+}
+
+/*
+ * The new buffer is only queued here; the work function swaps it in between
+ * two transfers so the refresh cycle keeps running across the resize.
+ *
+ * LED devices and channel indexes still follow the child LEDs in the device
+ * tree, so chips added past them can only be driven in raw mode. Channels cut
+ * off by a shorter chain keep their values but are left out of current_ua and
+ * energy_uj until the chain grows back.
+ */
+static ssize_t
+chain_length_store(struct device *const dev,
+				   struct device_attribute *const attr,
+				   const char *const buf, const size_t count)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	struct tlc5940_fb *next, *old = NULL;
+	unsigned long flags;
+	unsigned int chips;
+	bool busy;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &chips);
+	if (ret) {
+		return ret;
+	}
+
+	if (chips < 1 || chips > TLC5940_MAX_CHAIN) {
+		return -EINVAL;
+	}
+
+	next = tlc5940_fb_alloc(chips);
+	if (!next) {
+		return -ENOMEM;
+	}
+
+	/* held for as long as a buffer is queued for the swap */
+	static_branch_inc(&tlc5940_resize_key);
+
+	/*
+	 * Stream frames are sized and queued against the chain under the same
+	 * lock, so none queued for the current chain can outlive it.
+	 */
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		busy = !kfifo_is_empty(&tlc->frames) || tlc->stream_frame;
+		if (!busy) {
+			old = tlc->next_fb;
+			tlc->next_fb = next;
+			tlc->new_gs_data = 1;
+		}
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (busy) {
+		old = next;
+	}
+	if (old) {
+		static_branch_dec(&tlc5940_resize_key);
+		kfree(old);
+	}
+
+	return busy ? -EBUSY : count;
+
+}
+
+static ssize_t
+current_ua_show(struct device *const dev, struct device_attribute *const attr,
+				char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	u64 ua;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	ua = tlc5940_power_current_ua(tlc, tlc->power.total_gs);
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return sprintf(buf, "%llu\n", ua);
+
+}
+
+/* one value per chip in the chain, nearest to the controller first */
+static ssize_t
+chip_current_ua_show(struct device *const dev,
+					 struct device_attribute *const attr, char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	u32 chip_gs[TLC5940_MAX_CHAIN];
+	unsigned long flags;
+	unsigned int chips, i;
+	ssize_t len = 0;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	chips = tlc->fb->chips;
+	memcpy(chip_gs, tlc->power.chip_gs, sizeof(chip_gs));
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	for (i = 0; i < chips; i++) {
+		len += sprintf(
+		  buf + len,
+		  "%llu%c",
+		  tlc5940_power_current_ua(tlc, chip_gs[i]),
+		  i + 1 < chips ? ' ' : '\n'
+		);
+	}
+
+	return len;
+
+}
+
+static ssize_t
+energy_uj_show(struct device *const dev, struct device_attribute *const attr,
+			   char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	u64 uj;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	tlc5940_power_account(tlc);
+	uj = tlc->power.energy_uj;
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return sprintf(buf, "%llu\n", uj);
+
+}
+
+/* "<last> <max>" set-to-latch latency of urgent commits */
+static ssize_t
+urgent_latency_ns_show(struct device *const dev,
+					   struct device_attribute *const attr, char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	u64 last, max;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	last = tlc->urgent_latency_last_ns;
+	max = tlc->urgent_latency_max_ns;
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return sprintf(buf, "%llu %llu\n", last, max);
+
+}
+
+static ssize_t
+gs_depth_bits_show(struct device *const dev,
+				   struct device_attribute *const attr, char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(tlc->gs_depth_next));
+
+}
+
+static ssize_t
+gs_depth_bits_store(struct device *const dev,
+					struct device_attribute *const attr,
+					const char *const buf, const size_t count)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int bits, old;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &bits);
+	if (ret) {
+		return ret;
+	}
+
+	if (bits < TLC5940_GS_DEPTH_MIN || bits > TLC5940_GS_CHANNEL_WIDTH) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&tlc5940_stage_lock);
+
+	old = tlc->gs_depth_next;
+
+	/* the key must be on before the depth is seen by update_fb */
+	if (old == TLC5940_GS_CHANNEL_WIDTH && bits < TLC5940_GS_CHANNEL_WIDTH) {
+		static_branch_inc(&tlc5940_depth_key);
+	}
+
+	/* the period only follows once a frame at this depth is shifted out */
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		tlc->gs_depth_next = bits;
+		tlc->new_gs_data = 1;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (old < TLC5940_GS_CHANNEL_WIDTH && bits == TLC5940_GS_CHANNEL_WIDTH) {
+		static_branch_dec(&tlc5940_depth_key);
+	}
+
+	mutex_unlock(&tlc5940_stage_lock);
+
+	return count;
+
+}
+
+static ssize_t
+blank_phase_permille_show(struct device *const dev,
+						  struct device_attribute *const attr,
+						  char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(tlc->blank_phase));
+
+}
+
+static ssize_t
+blank_phase_permille_store(struct device *const dev,
+						   struct device_attribute *const attr,
+						   const char *const buf, const size_t count)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	int phase;
+	int ret;
+
+	ret = kstrtoint(buf, 0, &phase);
+	if (ret) {
+		return ret;
+	}
+
+	if (phase >= TLC5940_PHASE_SCALE) {
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(tlc->blank_phase, phase < 0 ? -1 : phase);
+	tlc5940_timer_realign(tlc);
+
+	return count;
+
+}
+
+static ssize_t
+max_rise_show(struct device *const dev, struct device_attribute *const attr,
+			  char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(tlc->max_rise));
+
+}
+
+/* must be called with tlc->lock held */
+static void
+tlc5940_set_max_rise(struct tlc5940 *const tlc, const u32 max_rise)
+{
+
+	int id;
+
+	if (max_rise && !tlc->max_rise) {
+		for (id = 0; id < tlc->num_leds; id++) {
+			tlc->leds[id].output = tlc5940_visible(tlc, id) ?
+			  tlc->leds[id].brightness : 0;
+		}
+		tlc->pending_rise = 0;
+	}
+
+	tlc->max_rise = max_rise;
+	tlc->new_gs_data = 1;
+
+}
+
+static ssize_t
+max_rise_store(struct device *const dev, struct device_attribute *const attr,
+			   const char *const buf, const size_t count)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	u32 max_rise, old;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &max_rise);
+	if (ret) {
+		return ret;
+	}
+
+	mutex_lock(&tlc5940_stage_lock);
+
+	old = tlc->max_rise;
+
+	/* the key must be on before the limit is seen by set_channel */
+	if (max_rise && !old) {
+		static_branch_inc(&tlc5940_inrush_key);
+	}
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	tlc5940_set_max_rise(tlc, max_rise);
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (!max_rise && old) {
+		static_branch_dec(&tlc5940_inrush_key);
+	}
+
+	mutex_unlock(&tlc5940_stage_lock);
+
+	return count;
+
+}
+
+static ssize_t
+raw_mode_show(struct device *const dev, struct device_attribute *const attr,
+			  char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(tlc->raw_mode));
+
+}
+
+static ssize_t
+raw_mode_store(struct device *const dev, struct device_attribute *const attr,
+			   const char *const buf, const size_t count)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	bool raw_mode, old;
+	int ret;
+
+	ret = kstrtobool(buf, &raw_mode);
+	if (ret) {
+		return ret;
+	}
+
+	mutex_lock(&tlc5940_stage_lock);
+
+	old = tlc->raw_mode;
+	if (raw_mode && !old) {
+		static_branch_inc(&tlc5940_raw_key);
+	}
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		tlc->raw_mode = raw_mode;
+		tlc->raw_pending = false;
+		tlc->new_gs_data = 1;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (!raw_mode && old) {
+		static_branch_dec(&tlc5940_raw_key);
+	}
+
+	mutex_unlock(&tlc5940_stage_lock);
+
+	/* stream readers and writers fail outside raw mode */
+	wake_up_interruptible(&tlc->frame_wait);
+	wake_up_interruptible(&tlc->latch_wait);
+
+	return count;
+
+}
+
+/*
+ * Takes one complete frame in the exact byte order shifted out over SPI: 12
+ * bits per channel, MSB first, starting with the last channel of the chip
+ * farthest from the controller. Values are not rescaled, so they must already
+ * fit the configured grayscale depth; tools/tlc5940-pack.c packs them.
+ *
+ * current_ua and energy_uj keep following the LED brightness values, not the
+ * raw frames actually shown.
+ */
+static ssize_t
+frame_write(struct file *const file, struct kobject *const kobj,
+			struct bin_attribute *const attr, char *const buf,
+			const loff_t off, const size_t count)
+{
+
+	struct device *const dev = kobj_to_dev(kobj);
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+	unsigned long flags;
+	ssize_t ret = count;
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		const struct tlc5940_fb *const fb = tlc->next_fb ? : tlc->fb;
+
+		if (!tlc->raw_mode) {
+			ret = -EPERM;
+		} else if (off != 0 || count != fb->len) {
+			ret = -EINVAL;
+		} else {
+			memcpy(tlc->raw, buf, count);
+			tlc->raw_len = count;
+			tlc->raw_pending = true;
+			tlc->new_gs_data = 1;
+		}
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	return ret;
+
+}
+
+/* master brightness scale in thousandths, set from the ambient light sensor */
+static ssize_t
+master_scale_show(struct device *const dev,
+				  struct device_attribute *const attr, char *const buf)
+{
+
+	struct tlc5940 *const tlc = dev_get_drvdata(dev);
+
+	return sprintf(
+	  buf,
+	  "%u\n",
+	  READ_ONCE(tlc->master_scale) * 1000 / TLC5940_SCALE_ONE
+	);
+
+}
+
+static DEVICE_ATTR_WO(hsv);
+static DEVICE_ATTR_WO(cct);
+static DEVICE_ATTR_RW(chain_length);
+static DEVICE_ATTR_RO(current_ua);
+static DEVICE_ATTR_RO(chip_current_ua);
+static DEVICE_ATTR_RO(energy_uj);
+static DEVICE_ATTR_RO(urgent_latency_ns);
+static DEVICE_ATTR_RW(gs_depth_bits);
+static DEVICE_ATTR_RW(max_rise);
+static DEVICE_ATTR_RW(blank_phase_permille);
+static DEVICE_ATTR_RW(raw_mode);
+static DEVICE_ATTR_RO(master_scale);
+static BIN_ATTR(frame, 0200, NULL, frame_write, 0);
+
+static struct attribute *tlc5940_attrs[] = {
+	&dev_attr_hsv.attr,
+	&dev_attr_cct.attr,
+	&dev_attr_chain_length.attr,
+	&dev_attr_current_ua.attr,
+	&dev_attr_chip_current_ua.attr,
+	&dev_attr_energy_uj.attr,
+	&dev_attr_urgent_latency_ns.attr,
+	&dev_attr_gs_depth_bits.attr,
+	&dev_attr_max_rise.attr,
+	&dev_attr_blank_phase_permille.attr,
+	&dev_attr_raw_mode.attr,
+	&dev_attr_master_scale.attr,
+	NULL
+};
+
+static struct bin_attribute *tlc5940_bin_attrs[] = {
+	&bin_attr_frame,
+	NULL
+};
+
+static const struct attribute_group tlc5940_attr_group = {
+	.attrs = tlc5940_attrs,
+	.bin_attrs = tlc5940_bin_attrs,
+};
+
+/* frees the device state once neither the driver nor a stream file holds it */
+static void
+tlc5940_release(struct kref *const refs)
+{
+
+	struct tlc5940 *const tlc = container_of(refs, struct tlc5940, refs);
+
+	if (tlc->next_fb) {
+		static_branch_dec(&tlc5940_resize_key);
+		kfree(tlc->next_fb);
+	}
+	kfree(tlc->fb);
+	kfree(tlc);
+
+}
+
+static void
+tlc5940_put(void *const data)
+{
+
+	struct tlc5940 *const tlc = data;
+
+	kref_put(&tlc->refs, tlc5940_release);
 
-#define TLC5940_BITS_PER_WORD 8
-#define TLC5940_MAX_SPEED_HZ ((u32) (30e6))
+}
 
-#define TLC5940_FB_SIZE_BITS ((TLC5940_MAX_LEDS) * TLC5940_GS_CHANNEL_WIDTH)
-#define TLC5940_FB_SIZE (TLC5940_FB_SIZE_BITS >> 3)
+static size_t
+tlc5940_stream_frame_len(struct tlc5940 *const tlc)
+{
 
-#define FB_OFFSET_BITS(__led)   ( \
-								  (TLC5940_FB_SIZE_BITS) - \
-								  (TLC5940_GS_CHANNEL_WIDTH * ((__led) + 1)) \
-								)
-#define FB_OFFSET(__led)        (FB_OFFSET_BITS(__led) >> 3)
+	unsigned long flags;
+	size_t len;
 
-struct tlc5940_led {
-	struct led_classdev ldev;
-	int                 id;
-	int                 brightness;
-	const char         *name;
-	struct tlc5940     *tlc;
+	spin_lock_irqsave(&tlc->lock, flags);
+	len = (tlc->next_fb ? : tlc->fb)->len;
+	spin_unlock_irqrestore(&tlc->lock, flags);
 
-	spinlock_t          lock;
-};
+	return len;
 
-struct tlc5940 {
-	struct tlc5940_led  leds[TLC5940_MAX_LEDS];
-	u8                  fb[TLC5940_FB_SIZE];
-	bool                new_gs_data;
+}
 
-	int                 gpio_blank;
-	struct hrtimer      timer;
+static int
+tlc5940_stream_open(struct inode *const inode, struct file *const file)
+{
 
-	struct work_struct  work;
-	struct spi_device  *spi;
-	struct pwm_device  *pwm;
+	struct tlc5940 *const tlc = container_of(
+	  file->private_data,
+	  struct tlc5940,
+	  misc
+	);
 
-};
+	if (test_and_set_bit(0, &tlc->stream_busy)) {
+		return -EBUSY;
+	}
 
-static enum hrtimer_restart
-tlc5940_timer_func(struct hrtimer *const timer)
+	kref_get(&tlc->refs);
+	file->private_data = tlc;
+
+	return nonseekable_open(inode, file);
+
+}
+
+/* detaches the command ring and drops any fades it started */
+static void
+tlc5940_ring_put(struct tlc5940 *const tlc)
 {
 
-	struct tlc5940 *const tlc = container_of(timer, struct tlc5940, timer);
-	struct spi_device *const spi = tlc->spi;
-	struct device *const dev = &spi->dev;
-	const int gpio_blank = tlc->gpio_blank;
+	struct tlc5940_ring *ring;
+	unsigned long flags;
+	int id;
 
-	hrtimer_forward_now(timer, ktime_set(0, TLC5940_BLANK_PERIOD_NS));
+	mutex_lock(&tlc5940_stage_lock);
 
-	if (!gpio_is_valid(gpio_blank)) {
-		dev_err(dev, "invalid gpio %d, expiring timer\n", gpio_blank);
-		return HRTIMER_NORESTART;
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		ring = tlc->ring;
+		tlc->ring = NULL;
+		/* the LEDs may already be gone once the device is stopped */
+		for (id = 0; id < tlc->num_leds && !tlc->stopping; id++) {
+			tlc->leds[id].fade_frames = 0;
+		}
+		tlc->fades = 0;
 	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+	if (ring) {
+		static_branch_dec(&tlc5940_ring_key);
+		vfree(ring);
+	}
+
+	mutex_unlock(&tlc5940_stage_lock);
+
+}
+
+static int
+tlc5940_stream_release(struct inode *const inode, struct file *const file)
+{
 
-	gpio_set_value(gpio_blank, 1);
-	gpio_set_value(gpio_blank, 0);
+	struct tlc5940 *const tlc = file->private_data;
+	unsigned long flags;
 
-	if (tlc->new_gs_data) {
-		schedule_work(&tlc->work);
+	/* no mapping of the ring is left once the file is released */
+	tlc5940_ring_put(tlc);
+
+	/* queued frames are sized for the current chain, which may change */
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		kfifo_reset(&tlc->frames);
+		kfifo_reset(&tlc->latched);
+		tlc->stream_frame = false;
+		tlc->stream_shifted = false;
 	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
 
-	return HRTIMER_RESTART;
+	clear_bit(0, &tlc->stream_busy);
+	kref_put(&tlc->refs, tlc5940_release);
+
+	return 0;
 
 }
 
-static void
-tlc5940_update_fb(struct tlc5940 *const tlc)
+static int
+tlc5940_stream_mmap(struct file *const file, struct vm_area_struct *const vma)
 {
 
-	u8 *const fb = &(tlc->fb[0]);
-	int id;
+	struct tlc5940 *const tlc = file->private_data;
+	struct tlc5940_ring *ring;
+	unsigned long flags;
+	int ret;
 
-	for (id = 0; id < TLC5940_MAX_LEDS; id++) {
+	if (vma->vm_pgoff ||
+		vma->vm_end - vma->vm_start != PAGE_ALIGN(sizeof(*ring))) {
+		return -EINVAL;
+	}
 
-		struct tlc5940_led *const led = &(tlc->leds[id]);
+	mutex_lock(&tlc5940_stage_lock);
 
-		const u16 brightness = led->brightness & 0xfff;
-		const u8 offset = FB_OFFSET(id);
-		const u8 mid_byte = id % 2 == 0;
+	if (READ_ONCE(tlc->stopping)) {
+		ret = -ENODEV;
+		goto out;
+	}
 
-		if (mid_byte) {
-			fb[offset] = (fb[offset] & 0xf0) | brightness >> 8;
-			fb[offset + 1] = brightness & 0xff;
+	if (tlc->ring) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ring = vmalloc_user(sizeof(*ring));
+	if (!ring) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = remap_vmalloc_range(vma, ring, 0);
+	if (ret) {
+		vfree(ring);
+		goto out;
+	}
+
+	static_branch_inc(&tlc5940_ring_key);
+
+	spin_lock_irqsave(&tlc->lock, flags);
+	{
+		tlc->ring = ring;
+		tlc->ring_tail = 0;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+out:
+	mutex_unlock(&tlc5940_stage_lock);
+
+	return ret;
+
+}
+
+/*
+ * Queues one or more complete raw frames, laid out as for the frame attribute.
+ * Blocks until all of them fit unless the file is non-blocking.
+ */
+static ssize_t
+tlc5940_stream_write(struct file *const file, const char __user *const buf,
+					 const size_t count, loff_t *const ppos)
+{
+
+	struct tlc5940 *const tlc = file->private_data;
+	const size_t len = tlc5940_stream_frame_len(tlc);
+	unsigned long flags;
+	u8 *frames;
+	int ret;
+
+	if (READ_ONCE(tlc->stopping)) {
+		return -ENODEV;
+	}
+
+	if (!READ_ONCE(tlc->raw_mode)) {
+		return -EPERM;
+	}
+
+	if (count == 0 || count % len || count > kfifo_size(&tlc->frames)) {
+		return -EINVAL;
+	}
+
+	/* never queue part of a frame, even when the copy faults */
+	frames = memdup_user(buf, count);
+	if (IS_ERR(frames)) {
+		return PTR_ERR(frames);
+	}
+
+	if (mutex_lock_interruptible(&tlc->frame_lock)) {
+		kfree(frames);
+		return -ERESTARTSYS;
+	}
+
+	if (file->f_flags & O_NONBLOCK) {
+		ret = kfifo_avail(&tlc->frames) < count ? -EAGAIN : 0;
+	} else {
+		ret = wait_event_interruptible(
+		  tlc->frame_wait,
+		  kfifo_avail(&tlc->frames) >= count ||
+		  READ_ONCE(tlc->stopping) || !READ_ONCE(tlc->raw_mode)
+		);
+	}
+	if (!ret && READ_ONCE(tlc->stopping)) {
+		ret = -ENODEV;
+	} else if (!ret && !READ_ONCE(tlc->raw_mode)) {
+		ret = -EPERM;
+	}
+	if (!ret) {
+		/* the chain may have been resized while this was waiting */
+		spin_lock_irqsave(&tlc->lock, flags);
+		if ((tlc->next_fb ? : tlc->fb)->len == len) {
+			kfifo_in(&tlc->frames, frames, count);
+			tlc->new_gs_data = 1;
 		} else {
-			fb[offset] = brightness >> 4;
-			fb[offset + 1] = (fb[offset + 1] & 0x0f) | ((brightness << 4 & 0xf0));
+			ret = -EINVAL;
 		}
-
+		spin_unlock_irqrestore(&tlc->lock, flags);
 	}
 
+	mutex_unlock(&tlc->frame_lock);
+	kfree(frames);
+
+	return ret ? : count;
+
 }
 
-static void
-tlc5940_work(struct work_struct *const work)
+/*
+ * Returns the latch times of completed frames, in order, as one u64 of
+ * CLOCK_MONOTONIC nanoseconds per frame.
+ */
+static ssize_t
+tlc5940_stream_read(struct file *const file, char __user *const buf,
+					const size_t count, loff_t *const ppos)
 {
 
-	struct tlc5940 *const tlc = container_of(work, struct tlc5940, work);
-	struct spi_device *const spi = tlc->spi;
-	struct device *const dev = &spi->dev;
-	u8 *const fb = &(tlc->fb[0]);
+	struct tlc5940 *const tlc = file->private_data;
+	u64 latched[16];
+	unsigned long flags;
+	unsigned int n = 0;
 	int ret;
 
-	tlc5940_update_fb(tlc);
+	if (READ_ONCE(tlc->stopping)) {
+		return -ENODEV;
+	}
 
-	ret = spi_write(spi, fb, TLC5940_FB_SIZE);
+	if (!READ_ONCE(tlc->raw_mode)) {
+		return -EPERM;
+	}
 
-	if (ret) {
-		dev_err(dev, "spi transfer error: %d\n", ret);
-		return;
+	if (count < sizeof(latched[0])) {
+		return -EINVAL;
 	}
 
-	tlc->new_gs_data = 0;
+	if (mutex_lock_interruptible(&tlc->latch_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	if (file->f_flags & O_NONBLOCK) {
+		ret = kfifo_is_empty(&tlc->latched) ? -EAGAIN : 0;
+	} else {
+		ret = wait_event_interruptible(
+		  tlc->latch_wait,
+		  !kfifo_is_empty(&tlc->latched) ||
+		  READ_ONCE(tlc->stopping) || !READ_ONCE(tlc->raw_mode)
+		);
+	}
+	if (!ret && READ_ONCE(tlc->stopping)) {
+		ret = -ENODEV;
+	} else if (!ret && !READ_ONCE(tlc->raw_mode)) {
+		ret = -EPERM;
+	}
+	if (!ret) {
+		n = kfifo_out(
+		  &tlc->latched,
+		  latched,
+		  min(count / sizeof(latched[0]), ARRAY_SIZE(latched))
+		);
+		if (copy_to_user(buf, latched, n * sizeof(latched[0]))) {
+			ret = -EFAULT;
+		}
+	}
+
+	mutex_unlock(&tlc->latch_lock);
+
+	/* frames held back for want of room may go out now */
+	if (n) {
+		spin_lock_irqsave(&tlc->lock, flags);
+		tlc->new_gs_data = 1;
+		spin_unlock_irqrestore(&tlc->lock, flags);
+	}
+
+	return ret ? : n * sizeof(latched[0]);
+
+}
+
+static unsigned int
+tlc5940_stream_poll(struct file *const file, poll_table *const wait)
+{
+
+	struct tlc5940 *const tlc = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &tlc->frame_wait, wait);
+	poll_wait(file, &tlc->latch_wait, wait);
+
+	if (READ_ONCE(tlc->stopping)) {
+		return POLLERR | POLLHUP;
+	}
+
+	/* read() and write() fail with -EPERM outside raw mode */
+	if (!READ_ONCE(tlc->raw_mode)) {
+		return POLLERR;
+	}
+
+	if (!kfifo_is_empty(&tlc->latched)) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	if (kfifo_avail(&tlc->frames) >= tlc5940_stream_frame_len(tlc)) {
+		mask |= POLLOUT | POLLWRNORM;
+	}
+
+	return mask;
+
+}
+
+static const struct file_operations tlc5940_stream_fops = {
+	.owner = THIS_MODULE,
+	.open = tlc5940_stream_open,
+	.release = tlc5940_stream_release,
+	.write = tlc5940_stream_write,
+	.read = tlc5940_stream_read,
+	.poll = tlc5940_stream_poll,
+	.mmap = tlc5940_stream_mmap,
+	.llseek = no_llseek,
+};
+
+static u32
+tlc5940_ambient_scale(const struct tlc5940 *const tlc, const u32 lux)
+{
+
+	const u32 min = tlc->ambient_lux_min;
+	const u32 max = tlc->ambient_lux_max;
+	const u32 min_scale = tlc->ambient_min_scale;
+
+	if (lux <= min) {
+		return min_scale;
+	}
+	if (lux >= max) {
+		return TLC5940_SCALE_ONE;
+	}
+
+	return min_scale +
+	  div_u64((u64) (TLC5940_SCALE_ONE - min_scale) * (lux - min), max - min);
 
 }
 
+/*
+ * Polls the ambient light sensor, smooths the readings with an exponential
+ * moving average and only moves the master scale once it differs from the
+ * smoothed target by more than the hysteresis band.
+ */
 static void
-tlc5940_set_brightness(struct led_classdev *const ldev,
-					   const enum led_brightness brightness)
+tlc5940_ambient_work(struct work_struct *const work)
 {
 
-	struct tlc5940_led *const led = container_of(
-	  ldev,
-	  struct tlc5940_led,
-	  ldev
+	struct tlc5940 *const tlc = container_of(
+	  to_delayed_work(work),
+	  struct tlc5940,
+	  ambient_work
 	);
+	struct device *const dev = &tlc->spi->dev;
+	unsigned long flags;
+	u32 lux, scale;
+	int val, delta, ret;
+
+	ret = IS_REACHABLE(CONFIG_IIO) ?
+	  iio_read_channel_processed(tlc->ambient, &val) : -ENODEV;
+	if (ret < 0) {
+		dev_err_ratelimited(dev, "failed to read ambient light: %d\n", ret);
+		goto out;
+	}
 
-	led->tlc->new_gs_data = 1;
+	val = max(val, 0);
+	if (!tlc->ambient_primed) {
+		tlc->ambient_smoothed = (s64) val << TLC5940_AMBIENT_FRAC_BITS;
+		tlc->ambient_primed = true;
+	} else {
+		tlc->ambient_smoothed +=
+		  (((s64) val << TLC5940_AMBIENT_FRAC_BITS) - tlc->ambient_smoothed) /
+		  (1 << TLC5940_AMBIENT_SMOOTHING);
+	}
 
-	spin_lock(&led->lock);
-	{
-		led->brightness = brightness;
+	lux = tlc->ambient_smoothed >> TLC5940_AMBIENT_FRAC_BITS;
+	scale = tlc5940_ambient_scale(tlc, lux);
+	delta = abs((int) scale - (int) tlc->master_scale);
+
+	/* the ends of the range are always reached, whatever the band */
+	spin_lock_irqsave(&tlc->lock, flags);
+	if (delta > TLC5940_AMBIENT_HYSTERESIS ||
+		(delta && (scale == TLC5940_SCALE_ONE ||
+				   scale == tlc->ambient_min_scale))) {
+		tlc5940_power_account(tlc);
+		tlc->master_scale = scale;
+		tlc->new_gs_data = 1;
+	}
+	spin_unlock_irqrestore(&tlc->lock, flags);
+
+out:
+	schedule_delayed_work(
+	  &tlc->ambient_work,
+	  msecs_to_jiffies(TLC5940_AMBIENT_POLL_MS)
+	);
+
+}
+
+/* takes the static keys for the stages configured at probe time */
+static void
+tlc5940_stages_get(struct tlc5940 *const tlc)
+{
+
+	mutex_lock(&tlc5940_stage_lock);
+
+	if (tlc->urgent) {
+		static_branch_inc(&tlc5940_urgent_key);
+	}
+	if (tlc->gs_depth_next < TLC5940_GS_CHANNEL_WIDTH) {
+		static_branch_inc(&tlc5940_depth_key);
+	}
+	if (tlc->max_rise) {
+		static_branch_inc(&tlc5940_inrush_key);
+	}
+	if (tlc->ambient) {
+		static_branch_inc(&tlc5940_scale_key);
+	}
+
+	mutex_unlock(&tlc5940_stage_lock);
+
+}
+
+static void
+tlc5940_stages_put(struct tlc5940 *const tlc)
+{
+
+	mutex_lock(&tlc5940_stage_lock);
+
+	if (tlc->urgent) {
+		static_branch_dec(&tlc5940_urgent_key);
+	}
+	if (tlc->gs_depth_next < TLC5940_GS_CHANNEL_WIDTH) {
+		static_branch_dec(&tlc5940_depth_key);
+	}
+	if (tlc->max_rise) {
+		static_branch_dec(&tlc5940_inrush_key);
+	}
+	if (tlc->raw_mode) {
+		static_branch_dec(&tlc5940_raw_key);
 	}
-	spin_unlock(&led->lock);
+	if (tlc->ambient) {
+		static_branch_dec(&tlc5940_scale_key);
+	}
+
+	mutex_unlock(&tlc5940_stage_lock);
+
+}
+
+static void
+tlc5940_stop(struct tlc5940 *const tlc)
+{
+
+	unsigned long flags;
+
+	/* an urgent commit in flight would otherwise re-arm the timer */
+	spin_lock_irqsave(&tlc->lock, flags);
+	tlc->stopping = true;
+	spin_unlock_irqrestore(&tlc->lock, flags);
+	cancel_work_sync(&tlc->work);
+
+	/* an open stream file only gets -ENODEV from here on */
+	wake_up_interruptible(&tlc->frame_wait);
+	wake_up_interruptible(&tlc->latch_wait);
+
+	cancel_delayed_work_sync(&tlc->ambient_work);
+	pwm_disable(tlc->pwm);
+	hrtimer_cancel(&tlc->timer);
+	cancel_work_sync(&tlc->work);
 
 }
 
@@ -173,22 +2441,100 @@ static int tlc5940_probe(struct spi_device *const spi)
 {
 	struct device *const dev = &(spi->dev);
 	struct device_node *const np = dev->of_node;
-	struct tlc5940 *const tlc = devm_kzalloc(
-	  &spi->dev,
-	  sizeof(struct tlc5940),
-	  GFP_KERNEL
-	);
+	struct tlc5940 *const tlc = kzalloc(sizeof(struct tlc5940), GFP_KERNEL);
 	struct hrtimer *const timer = &tlc->timer;
 	struct work_struct *const work = &tlc->work;
 	struct pwm_device *pwm;
 	struct tlc5940_led *led;
 	struct device_node *child;
+	u32 chips, depth, phase, lux_range[2], min_scale;
 	int i, ret;
 
 	if (!tlc) {
 		return -ENOMEM;
 	}
 
+	/* the driver's reference is dropped on unbind, like devm memory */
+	kref_init(&tlc->refs);
+	ret = devm_add_action_or_reset(dev, tlc5940_put, tlc);
+	if (ret) {
+		return ret;
+	}
+
+	i = of_get_child_count(np);
+	if (i > TLC5940_MAX_CHAIN * TLC5940_MAX_LEDS) {
+		dev_err(dev, "too many child LEDs: %d\n", i);
+		return -EINVAL;
+	}
+	tlc->leds = devm_kcalloc(dev, i, sizeof(*tlc->leds), GFP_KERNEL);
+	if (i && !tlc->leds) {
+		return -ENOMEM;
+	}
+
+	if (of_property_read_u32(np, "tlc,chain-length", &chips)) {
+		chips = max(DIV_ROUND_UP(i, TLC5940_MAX_LEDS), 1);
+	}
+	if (chips < 1 || chips > TLC5940_MAX_CHAIN) {
+		dev_err(dev, "invalid chain length %u\n", chips);
+		return -EINVAL;
+	}
+
+	if (of_property_read_u32(np, "tlc,gs-depth-bits", &depth)) {
+		depth = TLC5940_GS_CHANNEL_WIDTH;
+	}
+	if (depth < TLC5940_GS_DEPTH_MIN || depth > TLC5940_GS_CHANNEL_WIDTH) {
+		dev_err(dev, "invalid grayscale depth %u\n", depth);
+		return -EINVAL;
+	}
+	tlc->gs_depth = depth;
+	tlc->gs_depth_next = depth;
+	tlc->blank_period_ns = TLC5940_BLANK_PERIOD_NS(depth);
+
+	of_property_read_u32(np, "tlc,max-rise-per-frame", &tlc->max_rise);
+
+	if (of_property_read_u32(np, "tlc,blank-phase-permille", &phase)) {
+		tlc->blank_phase = -1;
+	} else if (phase < TLC5940_PHASE_SCALE) {
+		tlc->blank_phase = phase;
+	} else {
+		dev_err(dev, "invalid BLANK phase %u\n", phase);
+		return -EINVAL;
+	}
+
+	tlc->master_scale = TLC5940_SCALE_ONE;
+	/* IIO is optional; without it there is no ambient light sensor */
+	if (IS_REACHABLE(CONFIG_IIO)) {
+		tlc->ambient = devm_iio_channel_get(dev, "ambient");
+	} else {
+		tlc->ambient = ERR_PTR(-ENODEV);
+	}
+	if (IS_ERR(tlc->ambient)) {
+		ret = PTR_ERR(tlc->ambient);
+		if (ret != -ENODEV) {
+			if (ret != -EPROBE_DEFER) {
+				dev_err(dev, "failed to get ambient light channel: %d\n", ret);
+			}
+			return ret;
+		}
+		tlc->ambient = NULL;
+	}
+
+	if (of_property_read_u32_array(np, "tlc,ambient-lux-range", lux_range, 2)) {
+		lux_range[0] = 10;
+		lux_range[1] = 1000;
+	}
+	if (of_property_read_u32(np, "tlc,ambient-min-scale-permille",
+							 &min_scale)) {
+		min_scale = 100;
+	}
+	if (lux_range[0] >= lux_range[1] || min_scale > 1000) {
+		dev_err(dev, "invalid ambient light configuration\n");
+		return -EINVAL;
+	}
+	tlc->ambient_lux_min = lux_range[0];
+	tlc->ambient_lux_max = lux_range[1];
+	tlc->ambient_min_scale = min_scale * TLC5940_SCALE_ONE / 1000;
+
 	spi->bits_per_word = TLC5940_BITS_PER_WORD;
 	spi->max_speed_hz = TLC5940_MAX_SPEED_HZ;
 
@@ -229,16 +2575,44 @@ static int tlc5940_probe(struct spi_device *const spi)
 		return ret;
 	}
 
+	tlc->fb = tlc5940_fb_alloc(chips);
+	if (!tlc->fb) {
+		return -ENOMEM;
+	}
+
+	/* high priority for urgent commits, which skip the wait for the timer */
+	tlc->wq = alloc_ordered_workqueue("%s", WQ_HIGHPRI, dev_name(dev));
+	if (!tlc->wq) {
+		return -ENOMEM;
+	}
+
 	pwm_enable(pwm);
 
-	hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	timer->function = tlc5940_timer_func;
-	hrtimer_start(timer, ktime_set(1, 0), HRTIMER_MODE_REL);
+	hrtimer_start(
+	  timer,
+	  tlc5940_blank_slot(tlc, ktime_add(ktime_get(), ktime_set(1, 0))),
+	  HRTIMER_MODE_ABS
+	);
 
 	INIT_WORK(work, tlc5940_work);
 
+	spin_lock_init(&tlc->lock);
 	tlc->new_gs_data = 1;
 
+	INIT_DELAYED_WORK(&tlc->ambient_work, tlc5940_ambient_work);
+	mutex_init(&tlc->frame_lock);
+	mutex_init(&tlc->latch_lock);
+	init_waitqueue_head(&tlc->frame_wait);
+	init_waitqueue_head(&tlc->latch_wait);
+	INIT_KFIFO(tlc->frames);
+	INIT_KFIFO(tlc->latched);
+
+	of_property_read_u32(np, "tlc,max-current-microamp", &tlc->power.imax_ua);
+	of_property_read_u32(np, "tlc,supply-microvolt", &tlc->power.supply_uv);
+	tlc->power.last = ktime_get();
+
 	tlc->spi = spi;
 	tlc->pwm = pwm;
 
@@ -249,26 +2623,69 @@ static int tlc5940_probe(struct spi_device *const spi)
 		led->id = i;
 		led->tlc = tlc;
 		led->brightness = LED_OFF;
-		spin_lock_init(&led->lock);
 		led->ldev.name = led->name;
 		led->ldev.brightness = LED_OFF;
 		led->ldev.max_brightness = 0xfff;
 		led->ldev.brightness_set = tlc5940_set_brightness;
+		led->urgent = of_property_read_bool(child, "tlc,urgent");
+		tlc->urgent |= led->urgent;
 		ret = led_classdev_register(dev, &led->ldev);
 		if (ret < 0)
 			goto eledcr;
 		i++;
 	}
+	tlc->num_leds = i;
 
 	spi_set_drvdata(spi, tlc);
 
+	tlc5940_stages_get(tlc);
+
+	ret = sysfs_create_group(&dev->kobj, &tlc5940_attr_group);
+	if (ret) {
+		dev_err(dev, "failed to create sysfs attributes: %d\n", ret);
+		goto esysfs;
+	}
+
+	tlc5940_debugfs_init(tlc);
+
+	snprintf(
+	  tlc->misc_name,
+	  sizeof(tlc->misc_name),
+	  "tlc5940-%s",
+	  dev_name(dev)
+	);
+	tlc->misc.minor = MISC_DYNAMIC_MINOR;
+	tlc->misc.name = tlc->misc_name;
+	tlc->misc.fops = &tlc5940_stream_fops;
+	tlc->misc.parent = dev;
+	ret = misc_register(&tlc->misc);
+	if (ret) {
+		dev_err(dev, "failed to register stream device: %d\n", ret);
+		goto emisc;
+	}
+
+	if (tlc->ambient) {
+		schedule_delayed_work(&tlc->ambient_work, 0);
+	}
+
 	return 0;
 
+emisc:
+	debugfs_remove_recursive(tlc->debugfs);
+	tlc5940_fault_enable_set(tlc, 0);
+	sysfs_remove_group(&dev->kobj, &tlc5940_attr_group);
+esysfs:
+	tlc5940_stages_put(tlc);
+	goto eleds;
 eledcr:
 	dev_err(dev, "failed to set up child LED #%d: %d\n", i, ret);
+eleds:
 	while (i--)
 		led_classdev_unregister(&tlc->leds[i].ldev);
 
+	tlc5940_stop(tlc);
+	destroy_workqueue(tlc->wq);
+
 	return ret;
 }
 
@@ -276,21 +2693,24 @@ static int
 tlc5940_remove(struct spi_device *const spi)
 {
 	struct tlc5940 *const tlc = spi_get_drvdata(spi);
-	struct hrtimer *const timer = &tlc->timer;
-	struct work_struct *const work = &tlc->work;
-	struct pwm_device *const pwm = tlc->pwm;
 	struct tlc5940_led *led;
 	int i;
 
-	pwm_disable(pwm);
-	hrtimer_cancel(timer);
-	cancel_work_sync(work);
+	misc_deregister(&tlc->misc);
+	debugfs_remove_recursive(tlc->debugfs);
+	tlc5940_fault_enable_set(tlc, 0);
+	sysfs_remove_group(&spi->dev.kobj, &tlc5940_attr_group);
 
-	for (i = 0; i < TLC5940_MAX_LEDS; i++) {
+	/* unregistering turns the LEDs off, which may still queue the work */
+	for (i = 0; i < tlc->num_leds; i++) {
 		led = &tlc->leds[i];
 		led_classdev_unregister(&led->ldev);
 	}
 
+	tlc5940_stop(tlc);
+	destroy_workqueue(tlc->wq);
+	tlc5940_stages_put(tlc);
+
 	return 0;
 }
 
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2026
+ * agent <agent@local>
+ *
+ * This file is subject to the terms and conditions of version 2 of
+ * the GNU General Public License. See the file LICENSE in the main
+ * directory of this archive for more details.
+ *
+ * Userspace interface of the TLC5940 LED driver's stream device
+ */
+
+#ifndef __LEDS_TLC5940_H
+#define __LEDS_TLC5940_H
+
+#include <linux/types.h>
+
+/*
+ * In raw mode, write() takes whole frames in SPI shift order and read()
+ * returns one __u64 CLOCK_MONOTONIC latch time in nanoseconds per frame.
+ * tools/tlc5940-pack.h packs channel values into that order.
+ *
+ * The command ring is shared with the driver by mmap()ing the stream device
+ * at offset 0 with the size of struct tlc5940_ring, rounded up to whole pages.
+ * There is a single producer (the process that opened the device) and a
+ * single consumer (the driver, once per refresh cycle before packing).
+ *
+ * The producer fills cmds[head % TLC5940_RING_ENTRIES] and then publishes it
+ * by advancing head with release semantics; the driver advances tail once it
+ * has executed a command. Both indexes increase freely and wrap at 2^32.
+ */
+#define TLC5940_RING_ENTRIES    256
+
+/* terminates the channel list of a three-channel (RGB) group */
+#define TLC5940_CMD_NO_CHANNEL  0xffff
+
+enum tlc5940_cmd_op {
+	TLC5940_CMD_NOP,
+	/* channel[0] = value[0] */
+	TLC5940_CMD_SET,
+	/* moves channel[0] to value[0] over arg refresh cycles */
+	TLC5940_CMD_FADE,
+	/* hue arg (degrees), saturation value[0], value value[1] */
+	TLC5940_CMD_HSV,
+	/* color temperature arg (kelvin), intensity value[0] */
+	TLC5940_CMD_CCT,
+};
+
+struct tlc5940_cmd {
+	__u16 op;
+	__u16 arg;
+	__u16 value[2];
+	__u16 channel[4];
+};
+
+struct tlc5940_ring {
+	__u32 head;
+	__u32 pad0[15];
+	__u32 tail;
+	__u32 pad1[15];
+	struct tlc5940_cmd cmds[TLC5940_RING_ENTRIES];
+};
+
+#endif
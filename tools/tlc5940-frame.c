@@ -0,0 +1,75 @@
+/*
+ * Copyright 2026
+ * agent <agent@local>
+ *
+ * This file is subject to the terms and conditions of version 2 of
+ * the GNU General Public License. See the file LICENSE in the main
+ * directory of this archive for more details.
+ *
+ * Packs grayscale values read from stdin into raw TLC5940 frames on stdout
+ *
+ * Usage: tlc5940-frame <chips> < values > /dev/tlc5940-spi0.0
+ *
+ * Each frame is 16 whitespace separated values per chip in the chain, in
+ * channel order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tlc5940-pack.h"
+
+#define MAX_CHAIN 16
+
+int
+main(int argc, char **argv)
+{
+
+	uint16_t gs[TLC5940_PACK_CHANNELS(MAX_CHAIN)];
+	uint8_t frame[TLC5940_PACK_FRAME_SIZE(MAX_CHAIN)];
+	unsigned int chips, value;
+	size_t i, channels;
+	char *end;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <chips>\n", argv[0]);
+		return 2;
+	}
+
+	chips = strtoul(argv[1], &end, 0);
+	if (*end || chips < 1 || chips > MAX_CHAIN) {
+		fprintf(stderr, "invalid chain length `%s'\n", argv[1]);
+		return 2;
+	}
+	channels = TLC5940_PACK_CHANNELS(chips);
+
+	for (;;) {
+		for (i = 0; i < channels; i++) {
+			if (scanf("%u", &value) != 1) {
+				break;
+			}
+			if (value > 0xfff) {
+				fprintf(stderr, "value out of range: %u\n", value);
+				return 1;
+			}
+			gs[i] = value;
+		}
+
+		if (i == 0 && feof(stdin)) {
+			break;
+		}
+		if (i < channels) {
+			fprintf(stderr, "incomplete frame\n");
+			return 1;
+		}
+
+		tlc5940_pack(gs, chips, frame);
+		if (fwrite(frame, TLC5940_PACK_FRAME_SIZE(chips), 1, stdout) != 1) {
+			perror("write");
+			return 1;
+		}
+	}
+
+	return fflush(stdout) ? 1 : 0;
+
+}
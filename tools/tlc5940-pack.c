@@ -0,0 +1,137 @@
+/*
+ * Copyright 2026
+ * agent <agent@local>
+ *
+ * This file is subject to the terms and conditions of version 2 of
+ * the GNU General Public License. See the file LICENSE in the main
+ * directory of this archive for more details.
+ *
+ * Reference packer for the TLC5940 LED driver's raw frames
+ */
+
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "tlc5940-pack.h"
+
+/*
+ * The SIMD paths take eight channels at a time. Loaded little endian, each
+ * 32-bit lane holds an even channel in its low half and the next odd channel
+ * in its high half; in shift order the odd channel comes first, so the lane
+ * is folded into (odd << 12 | even) and its low three bytes are written out
+ * most significant first, highest lane first.
+ */
+#if defined(__SSSE3__) || defined(__ARM_NEON)
+static const uint8_t tlc5940_pack_order[16] = {
+	14, 13, 12, 10, 9, 8, 6, 5, 4, 2, 1, 0,
+	0x80, 0x80, 0x80, 0x80,
+};
+#endif
+
+void
+tlc5940_pack_scalar(const uint16_t *gs, unsigned int chips,
+					uint8_t *frame)
+{
+
+	const size_t channels = TLC5940_PACK_CHANNELS(chips);
+	size_t i;
+
+	for (i = channels; i > 0; i -= 2) {
+		const uint16_t odd = gs[i - 1] & 0xfff;
+		const uint16_t even = gs[i - 2] & 0xfff;
+
+		*frame++ = odd >> 4;
+		*frame++ = (odd & 0x0f) << 4 | even >> 8;
+		*frame++ = even & 0xff;
+	}
+
+}
+
+#if defined(__SSSE3__)
+
+void
+tlc5940_pack(const uint16_t *gs, unsigned int chips, uint8_t *frame)
+{
+
+	const size_t channels = TLC5940_PACK_CHANNELS(chips);
+	const __m128i order = _mm_loadu_si128((const __m128i *) tlc5940_pack_order);
+	const __m128i gs_mask = _mm_set1_epi16(0xfff);
+	const __m128i even_mask = _mm_set1_epi32(0x000fff);
+	const __m128i odd_mask = _mm_set1_epi32(0xfff000);
+	uint8_t out[16];
+	size_t i;
+
+	for (i = channels; i > 0; i -= 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) &gs[i - 8]);
+
+		x = _mm_and_si128(x, gs_mask);
+		x = _mm_or_si128(
+		  _mm_and_si128(x, even_mask),
+		  _mm_and_si128(_mm_srli_epi32(x, 4), odd_mask)
+		);
+		_mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(x, order));
+		memcpy(frame, out, 12);
+		frame += 12;
+	}
+
+}
+
+#elif defined(__ARM_NEON)
+
+void
+tlc5940_pack(const uint16_t *gs, unsigned int chips, uint8_t *frame)
+{
+
+	const size_t channels = TLC5940_PACK_CHANNELS(chips);
+	const uint8x16_t order = vld1q_u8(tlc5940_pack_order);
+	uint8_t out[16];
+	size_t i;
+
+	for (i = channels; i > 0; i -= 8) {
+		uint32x4_t x = vreinterpretq_u32_u16(
+		  vandq_u16(vld1q_u16(&gs[i - 8]), vdupq_n_u16(0xfff))
+		);
+		uint8x16_t packed;
+
+		x = vorrq_u32(
+		  vandq_u32(x, vdupq_n_u32(0x000fff)),
+		  vandq_u32(vshrq_n_u32(x, 4), vdupq_n_u32(0xfff000))
+		);
+#if defined(__aarch64__)
+		packed = vqtbl1q_u8(vreinterpretq_u8_u32(x), order);
+#else
+		{
+			const uint8x16_t bytes = vreinterpretq_u8_u32(x);
+			const uint8x8x2_t table = {
+				{ vget_low_u8(bytes), vget_high_u8(bytes) }
+			};
+
+			packed = vcombine_u8(
+			  vtbl2_u8(table, vget_low_u8(order)),
+			  vtbl2_u8(table, vget_high_u8(order))
+			);
+		}
+#endif
+		vst1q_u8(out, packed);
+		memcpy(frame, out, 12);
+		frame += 12;
+	}
+
+}
+
+#else
+
+void
+tlc5940_pack(const uint16_t *gs, unsigned int chips, uint8_t *frame)
+{
+
+	tlc5940_pack_scalar(gs, chips, frame);
+
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2026
+ * agent <agent@local>
+ *
+ * This file is subject to the terms and conditions of version 2 of
+ * the GNU General Public License. See the file LICENSE in the main
+ * directory of this archive for more details.
+ *
+ * Reference packer for the TLC5940 LED driver's raw frames
+ */
+
+#ifndef __TLC5940_PACK_H
+#define __TLC5940_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TLC5940_PACK_CHANNELS(chips)   ((chips) * 16)
+#define TLC5940_PACK_FRAME_SIZE(chips) ((chips) * 24)
+
+/*
+ * Packs one grayscale value per channel, indexed like the driver's LEDs
+ * (channel 0 is OUT0 of the chip nearest to the controller), into a raw frame
+ * for the frame attribute or the stream device: 12 bits per channel, MSB
+ * first, starting with the last channel of the chip farthest from the
+ * controller. Only the low 12 bits of each value are used.
+ *
+ * frame must hold TLC5940_PACK_FRAME_SIZE(chips) bytes.
+ */
+void
+tlc5940_pack(const uint16_t *gs, unsigned int chips, uint8_t *frame);
+
+/* portable version of tlc5940_pack(), also used where no SIMD path exists */
+void
+tlc5940_pack_scalar(const uint16_t *gs, unsigned int chips, uint8_t *frame);
+
+#endif